@@ -1,8 +1,16 @@
-#include <linux/dmi.h>
+#include <linux/debugfs.h>
 #include <linux/hid.h>
+#include <linux/hrtimer.h>
+#include <linux/input.h>
 #include <linux/module.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 //#include "hid-ids.h"
 
@@ -14,6 +22,29 @@
 #define MSI_CLAW_GAME_CONTROL_DESC   0x05
 #define MSI_CLAW_DEVICE_CONTROL_DESC 0x06
 
+#define MSI_CLAW_MACRO_SLOTS 2
+#define MSI_CLAW_MACRO_MAX_EVENTS 256
+
+#define MSI_CLAW_REMAP_PROFILES 4
+
+// bucket n counts latencies in [2^(n-1), 2^n) ns, the last one everything above
+#define MSI_CLAW_LATENCY_BUCKETS 32
+
+// timeout used for a command before any round trip time has been measured
+#define MSI_CLAW_TIMEOUT_INITIAL_MS 1000
+// first answer to a command, then any further one
+#define MSI_CLAW_RTT_STEPS 2
+
+#define MSI_CLAW_CAPTURE_ENTRIES 256
+#define MSI_CLAW_CAPTURE_MAGIC "MCLC"
+#define MSI_CLAW_CAPTURE_VERSION 2
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+#define MSI_CLAW_BIN_ATTR_CONST const
+#else
+#define MSI_CLAW_BIN_ATTR_CONST
+#endif
+
 enum msi_claw_gamepad_mode {
 	MSI_CLAW_GAMEPAD_MODE_OFFLINE = 0x00,
 	MSI_CLAW_GAMEPAD_MODE_XINPUT = 0x01,
@@ -36,17 +67,68 @@ enum msi_claw_mkeys_function {
 
 static const bool gamepad_mode_debug = false;
 
+static bool latency_timestamps;
+module_param(latency_timestamps, bool, 0644);
+MODULE_PARM_DESC(latency_timestamps, "Timestamp input events with the arrival time of their report");
+
+static unsigned int autosuspend_delay_ms = 2000;
+module_param(autosuspend_delay_ms, uint, 0644);
+MODULE_PARM_DESC(autosuspend_delay_ms, "Idle time before the control interface is closed and allowed to suspend");
+
+static unsigned int timeout_min_ms = 50;
+module_param(timeout_min_ms, uint, 0644);
+MODULE_PARM_DESC(timeout_min_ms, "Lower bound of the adaptive command timeout");
+
+static unsigned int timeout_max_ms = 5000;
+module_param(timeout_max_ms, uint, 0644);
+MODULE_PARM_DESC(timeout_max_ms, "Upper bound of the adaptive command timeout");
+
+static unsigned int cmd_timeout_ms[5];
+module_param_array(cmd_timeout_ms, uint, NULL, 0644);
+MODULE_PARM_DESC(cmd_timeout_ms,
+	"Fixed timeout for switch_mode,sync_to_rom,reset,read_mode,other commands (0: adaptive)");
+
+static bool monitor_mode;
+module_param(monitor_mode, bool, 0444);
+MODULE_PARM_DESC(monitor_mode,
+	"Keep the control interface open to catch mode changes made on the device (prevents autosuspend)");
+
+static bool allow_non_usb;
+module_param(allow_non_usb, bool, 0644);
+MODULE_PARM_DESC(allow_non_usb, "Bind to non-usb transports too, e.g. uhid for capture replay");
+
 static const struct {
 	const char* name;
-	const bool available;
 } gamepad_mode_map[] = {
-	{"offline", gamepad_mode_debug},
-	{"xinput", true},
-	{"dinput", gamepad_mode_debug},
-	{"msi", gamepad_mode_debug},
-	{"desktop", true},
-	{"bios", gamepad_mode_debug},
-	{"testing", gamepad_mode_debug},
+	{"offline"},
+	{"xinput"},
+	{"dinput"},
+	{"msi"},
+	{"desktop"},
+	{"bios"},
+	{"testing"},
+};
+
+/*
+ * Device specific behaviour, kept in one place. There is a single set as
+ * no model or firmware is known yet to work with a shorter command
+ * sequence than the one every device has been driven with so far.
+ */
+struct msi_claw_quirks {
+	// modes that can be selected, as BIT(enum msi_claw_gamepad_mode)
+	unsigned long gamepad_modes;
+	unsigned int resume_delay_ms;
+	// switch mode and sync to rom are answered with two acks
+	bool double_ack;
+	// read the mode back after a switch, as the official application does
+	bool verify_switch;
+};
+
+static const struct msi_claw_quirks msi_claw_quirks_default = {
+	.gamepad_modes = BIT(MSI_CLAW_GAMEPAD_MODE_XINPUT) | BIT(MSI_CLAW_GAMEPAD_MODE_DESKTOP),
+	.resume_delay_ms = 500,
+	.double_ack = true,
+	.verify_switch = true,
 };
 
 static const char* mkeys_function_map[] =
@@ -91,25 +173,265 @@ struct msi_claw_control_status {
 struct msi_claw_read_data {
 	const uint8_t *data;
 	int size;
+	ktime_t timestamp;
 
 	struct msi_claw_read_data *next;
 };
 
+/*
+ * Layout of a macro as written to the "macro" binary attribute: one header
+ * followed by header.count events. Each event is emitted delay_us
+ * microseconds after the previous one (or after playback start for the
+ * first one); events with a zero delay are reported in the same frame.
+ */
+struct msi_claw_macro_header {
+	uint8_t slot;
+	uint8_t reserved;
+	__le16 count;
+} __packed;
+
+struct msi_claw_macro_event {
+	__le16 code;
+	uint8_t value;
+	uint8_t reserved;
+	__le32 delay_us;
+} __packed;
+
+struct msi_claw_macro {
+	int count;
+	struct msi_claw_macro_event events[];
+};
+
+/*
+ * Button remap table: codes[c] is the key code reported in place of c.
+ * Readers in the input path only ever see a complete table, updates publish
+ * a new one through RCU.
+ */
+struct msi_claw_remap {
+	struct rcu_head rcu;
+	uint16_t codes[KEY_CNT];
+};
+
+enum msi_claw_capture_direction {
+	MSI_CLAW_CAPTURE_IN = 0x00,
+	MSI_CLAW_CAPTURE_OUT = 0x01,
+	// sysfs access starting a transaction: "<attribute>" for reads, "<attribute>=<value>" for writes
+	MSI_CLAW_CAPTURE_ACTION = 0x02,
+};
+
+// the report was longer than the capture entries and got cut
+#define MSI_CLAW_CAPTURE_TRUNCATED 0x01
+
+// ring entries are capture_size bytes of data long, sized after the longest report
+struct msi_claw_capture_entry {
+	// 0 while the entry is being written, otherwise its position + 1
+	unsigned long seq;
+	u64 timestamp_ns;
+	uint8_t direction;
+	uint8_t flags;
+	uint16_t size;
+	uint8_t data[];
+};
+
+/*
+ * Capture file as read from debugfs: one header followed by records of
+ * variable length, each one carrying record.size bytes of report data.
+ */
+struct msi_claw_capture_header {
+	char magic[4];
+	__le16 version;
+	__le16 reserved;
+} __packed;
+
+struct msi_claw_capture_record {
+	__le64 timestamp_ns;
+	uint8_t direction;
+	uint8_t flags;
+	__le16 size;
+} __packed;
+
+struct msi_claw_capture_snapshot {
+	size_t len;
+	uint8_t data[];
+};
+
+// commands whose answer times are tracked separately, in cmd_timeout_ms order
+enum msi_claw_rtt_slot {
+	MSI_CLAW_RTT_SWITCH_MODE,
+	MSI_CLAW_RTT_SYNC_TO_ROM,
+	MSI_CLAW_RTT_RESET_DEVICE,
+	MSI_CLAW_RTT_READ_GAMEPAD_MODE,
+	MSI_CLAW_RTT_OTHER,
+
+	MSI_CLAW_RTT_MAX,
+};
+
+static_assert(ARRAY_SIZE(cmd_timeout_ms) == MSI_CLAW_RTT_MAX);
+
+static const char *rtt_slot_map[] = {
+	"switch_mode",
+	"sync_to_rom",
+	"reset",
+	"read_mode",
+	"other",
+};
+
+// smoothed round trip time and its mean deviation, as TCP does (RFC 6298)
+struct msi_claw_rtt {
+	u32 srtt_us;
+	u32 rttvar_us;
+	// the timeout doubles on each expiry until the next sample
+	unsigned int backoff;
+};
+
 struct msi_claw_drvdata {
 	struct hid_device *hdev;
 
-	//struct input_dev *input;
+	// macro playback device, only present on the control interface
+	struct input_dev *input;
 
 	struct msi_claw_control_status *control;
 
-	struct mutex read_data_mutex;
+	const struct msi_claw_quirks *quirks;
+
+	spinlock_t read_data_lock;
 	struct msi_claw_read_data *read_data;
+	wait_queue_head_t read_wait;
+
+	// last command sent and when it, or its last answer, went through
+	enum msi_claw_command_type last_cmd;
+	ktime_t last_write;
+	ktime_t last_io;
+	unsigned int io_step;
+	struct msi_claw_rtt rtt[MSI_CLAW_RTT_MAX][MSI_CLAW_RTT_STEPS];
+
+	// the control interface is open only while a transaction is in flight
+	struct mutex io_mutex;
+	struct delayed_work idle_work;
+	bool opened;
+	bool suspended;
+	// kept open by monitor_mode, reports arriving outside a transaction are unsolicited
+	bool monitor;
+	bool in_transaction;
+
+	// system sleep, as opposed to autosuspend, only touched by the pm callbacks
+	bool system_sleep;
+	// restores the gamepad mode once resumed from system sleep
+	struct work_struct resume_work;
+	bool resuming;
+
+	// tells userspace the gamepad mode or mkeys function may have changed
+	struct work_struct notify_work;
+
+	struct mutex macro_mutex;
+	struct msi_claw_macro *macros[MSI_CLAW_MACRO_SLOTS];
+	struct hrtimer macro_timer;
+	const struct msi_claw_macro *macro_playing;
+	int macro_pos;
+
+	// key code of the M-key starting each slot, 0 when not bound
+	uint16_t macro_trigger[MSI_CLAW_MACRO_SLOTS];
+	struct work_struct macro_work;
+	unsigned int macro_pending;
+	// slots whose M-key is held: every report repeats its state, only a press starts the macro
+	unsigned long macro_held;
+
+	// control interfaces are listed so that the input ones can find theirs
+	struct list_head control_node;
+	struct device *parent;
+
+	// remap of the interfaces exposing input devices
+	struct mutex remap_mutex;
+	struct msi_claw_remap __rcu *remap;
+	struct msi_claw_remap *remap_profiles[MSI_CLAW_REMAP_PROFILES];
+	unsigned int remap_profile;
+
+	// code reported for each held key, 0 when released, so releases survive a remap change
+	uint16_t remap_pressed[KEY_CNT];
+	// held keys remapped to each code: its own usage must not release it meanwhile
+	uint16_t remap_holders[KEY_CNT];
+
+	// arrival time of the report being processed and how long it took to dispatch
+	ktime_t report_arrival;
+	u64 latency_count;
+	u64 latency_max_ns;
+	u64 latency_hist[MSI_CLAW_LATENCY_BUCKETS];
+
+	struct dentry *debugfs;
+
+	// raw traffic capture, written without locks from any context
+	bool capture;
+	atomic_long_t capture_head;
+	size_t capture_size;
+	uint8_t *capture_ring;
 };
 
+// control interfaces, looked up from the input path of their sibling interfaces
+static LIST_HEAD(msi_claw_controls);
+static DEFINE_SPINLOCK(msi_claw_controls_lock);
+
+// interfaces of the same usb device share the grandparent device
+static struct device *msi_claw_parent(struct hid_device *hdev)
+{
+	return hdev->dev.parent ? hdev->dev.parent->parent : NULL;
+}
+
+static size_t msi_claw_capture_stride(size_t capture_size)
+{
+	return ALIGN(sizeof(struct msi_claw_capture_entry) + capture_size, __alignof__(struct msi_claw_capture_entry));
+}
+
+static struct msi_claw_capture_entry *msi_claw_capture_entry(struct msi_claw_drvdata *drvdata, unsigned long pos)
+{
+	size_t stride = msi_claw_capture_stride(drvdata->capture_size);
+
+	return (struct msi_claw_capture_entry *)&drvdata->capture_ring[(pos % MSI_CLAW_CAPTURE_ENTRIES) * stride];
+}
+
+static void msi_claw_capture(struct msi_claw_drvdata *drvdata, enum msi_claw_capture_direction direction,
+	const uint8_t *data, int size, ktime_t timestamp)
+{
+	struct msi_claw_capture_entry *entry;
+	unsigned long pos;
+
+	if ((!READ_ONCE(drvdata->capture)) || (drvdata->capture_ring == NULL))
+		return;
+
+	pos = atomic_long_inc_return(&drvdata->capture_head) - 1;
+	entry = msi_claw_capture_entry(drvdata, pos);
+
+	WRITE_ONCE(entry->seq, 0);
+	smp_wmb();
+
+	entry->timestamp_ns = ktime_to_ns(timestamp);
+	entry->direction = direction;
+	entry->flags = (size > drvdata->capture_size) ? MSI_CLAW_CAPTURE_TRUNCATED : 0;
+	entry->size = min_t(size_t, size, drvdata->capture_size);
+	memcpy(entry->data, data, entry->size);
+
+	smp_wmb();
+	WRITE_ONCE(entry->seq, pos + 1);
+}
+
+// longest report of the device, so that captured reports are kept whole
+static size_t msi_claw_capture_size(struct hid_device *hdev)
+{
+	struct hid_report *report;
+	size_t size = MSI_CLAW_WRITE_SIZE;
+	int type;
+
+	for (type = HID_INPUT_REPORT; type <= HID_FEATURE_REPORT; type++)
+		list_for_each_entry(report, &hdev->report_enum[type].report_list, list)
+			size = max_t(size_t, size, hid_report_len(report));
+
+	return min_t(size_t, size, U16_MAX);
+}
+
 static int msi_claw_write_cmd(struct hid_device *hdev, enum msi_claw_command_type cmdtype,
     const uint8_t *const buffer, size_t buffer_len)
 {
 	int ret;
+	ktime_t sent;
 	uint8_t *dmabuf = NULL;
 	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
 	const uint8_t buf[MSI_CLAW_WRITE_SIZE] = {
@@ -134,12 +456,23 @@ static int msi_claw_write_cmd(struct hid_device *hdev, enum msi_claw_command_typ
 		goto msi_claw_write_cmd_err;
 	}
 
+	// taken before sending as the answer may come in before the write returns
+	sent = ktime_get();
+
+	// logged ahead of the answer, even when sending fails: a replay issues it all the same
+	msi_claw_capture(drvdata, MSI_CLAW_CAPTURE_OUT, dmabuf, MSI_CLAW_WRITE_SIZE, sent);
+
 	ret = hid_hw_output_report(hdev, dmabuf, MSI_CLAW_WRITE_SIZE);
 	if (ret != MSI_CLAW_WRITE_SIZE) {
 		hid_err(hdev, "hid-msi-claw failed to switch controller mode: %d\n", ret);
 		goto msi_claw_write_cmd_err;
 	}
 
+	drvdata->last_cmd = cmdtype;
+	drvdata->last_write = sent;
+	drvdata->last_io = sent;
+	drvdata->io_step = 0;
+
 	hid_notice(hdev, "hid-msi-claw sent %d bytes, cmd: 0x%02x\n", ret, dmabuf[4]);
 
 msi_claw_write_cmd_err:
@@ -148,10 +481,78 @@ msi_claw_write_cmd_err:
 	return ret;
 }
 
-static int msi_claw_read(struct hid_device *hdev, uint8_t *const buffer, int size, uint32_t timeout)
+static enum msi_claw_rtt_slot msi_claw_rtt_slot(enum msi_claw_command_type cmdtype)
+{
+	switch (cmdtype) {
+	case MSI_CLAW_COMMAND_TYPE_SWITCH_MODE:
+		return MSI_CLAW_RTT_SWITCH_MODE;
+	case MSI_CLAW_COMMAND_TYPE_SYNC_TO_ROM:
+		return MSI_CLAW_RTT_SYNC_TO_ROM;
+	case MSI_CLAW_COMMAND_TYPE_RESET_DEVICE:
+		return MSI_CLAW_RTT_RESET_DEVICE;
+	case MSI_CLAW_COMMAND_TYPE_READ_GAMEPAD_MODE:
+		return MSI_CLAW_RTT_READ_GAMEPAD_MODE;
+	default:
+		return MSI_CLAW_RTT_OTHER;
+	}
+}
+
+static unsigned int msi_claw_timeout_ms(const struct msi_claw_drvdata *drvdata, enum msi_claw_rtt_slot slot,
+	unsigned int step)
+{
+	const struct msi_claw_rtt *rtt = &drvdata->rtt[slot][step];
+	unsigned int timeout, upper = max(timeout_min_ms, timeout_max_ms);
+
+	if (cmd_timeout_ms[slot])
+		return cmd_timeout_ms[slot];
+
+	if (!rtt->srtt_us)
+		timeout = MSI_CLAW_TIMEOUT_INITIAL_MS;
+	else
+		timeout = DIV_ROUND_UP(rtt->srtt_us + 4 * rtt->rttvar_us, USEC_PER_MSEC);
+
+	// RFC 6298 5.5: back off on expiry, up to the upper bound
+	timeout = clamp(timeout, timeout_min_ms, upper);
+	if ((rtt->backoff >= BITS_PER_TYPE(timeout)) || (timeout > (upper >> rtt->backoff)))
+		return upper;
+
+	return timeout << rtt->backoff;
+}
+
+static void msi_claw_rtt_timeout(struct msi_claw_drvdata *drvdata, enum msi_claw_rtt_slot slot, unsigned int step)
+{
+	struct msi_claw_rtt *rtt = &drvdata->rtt[slot][step];
+
+	if (rtt->backoff < BITS_PER_TYPE(unsigned int))
+		rtt->backoff++;
+}
+
+static void msi_claw_rtt_sample(struct msi_claw_drvdata *drvdata, enum msi_claw_rtt_slot slot, unsigned int step,
+	s64 sample_us)
+{
+	struct msi_claw_rtt *rtt = &drvdata->rtt[slot][step];
+	u32 sample = clamp_t(s64, sample_us, 1, U32_MAX / 8);
+
+	rtt->backoff = 0;
+
+	if (!rtt->srtt_us) {
+		rtt->srtt_us = sample;
+		rtt->rttvar_us = sample / 2;
+		return;
+	}
+
+	rtt->rttvar_us = (3 * rtt->rttvar_us + abs((s32)rtt->srtt_us - (s32)sample)) / 4;
+	rtt->srtt_us = (7 * rtt->srtt_us + sample) / 8;
+}
+
+static int msi_claw_read(struct hid_device *hdev, uint8_t *const buffer, int size)
 {
 	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
 	struct msi_claw_read_data *event = NULL;
+	enum msi_claw_rtt_slot slot = msi_claw_rtt_slot(drvdata->last_cmd);
+	unsigned int step = drvdata->io_step;
+	unsigned int timeout = msi_claw_timeout_ms(drvdata, slot, step);
+	unsigned long deadline = jiffies + msecs_to_jiffies(timeout);
 	int ret = 0;
 
 	if (!drvdata->control) {
@@ -160,24 +561,39 @@ static int msi_claw_read(struct hid_device *hdev, uint8_t *const buffer, int siz
 		goto msi_claw_read_err;
 	}
 
-	for (uint32_t i = 0; (event == NULL) && (i <= timeout); i++) {
-		if (timeout - i)
-			msleep(20);
+	for (;;) {
+		wait_event_timeout(drvdata->read_wait, READ_ONCE(drvdata->read_data) != NULL,
+			max_t(long, (long)(deadline - jiffies), 0));
 
-		scoped_guard(mutex, &drvdata->read_data_mutex) {
+		scoped_guard(spinlock_irqsave, &drvdata->read_data_lock) {
 			event = drvdata->read_data;
 
 			if (event != NULL)
 				drvdata->read_data = event->next;
-		};
+		}
+
+		if ((event == NULL) || !ktime_before(event->timestamp, drvdata->last_write))
+			break;
+
+		// late answer to a command that already timed out: neither an answer nor a sample
+		hid_dbg(hdev, "hid-msi-claw dropping stale answer, cmd: 0x%02x\n", event->data[4]);
+		kfree(event->data);
+		kfree(event);
+		event = NULL;
 	}
 
 	if (event == NULL) {
-		ret = -EIO;
-		hid_err(hdev, "hid-msi-claw no answer from device\n");
+		ret = -ETIMEDOUT;
+		msi_claw_rtt_timeout(drvdata, slot, step);
+		hid_err(hdev, "hid-msi-claw no answer from device in %u ms\n", timeout);
 		goto msi_claw_read_err;
 	}
 
+	// every answer is timed from the previous step of the same transaction
+	msi_claw_rtt_sample(drvdata, slot, step, ktime_us_delta(event->timestamp, drvdata->last_io));
+	drvdata->last_io = event->timestamp;
+	drvdata->io_step = min(step + 1, MSI_CLAW_RTT_STEPS - 1);
+
 	if (size < event->size) {
 		ret = -EINVAL;
 		hid_err(hdev, "hid-msi-claw invalid buffer size: too short\n");
@@ -196,13 +612,135 @@ msi_claw_read_err:
 	return ret;
 }
 
+static void msi_claw_flush_read_data(struct msi_claw_drvdata *drvdata)
+{
+	struct msi_claw_read_data *event;
+
+	scoped_guard(spinlock_irqsave, &drvdata->read_data_lock) {
+		while (drvdata->read_data != NULL) {
+			event = drvdata->read_data;
+			drvdata->read_data = event->next;
+
+			kfree(event->data);
+			kfree(event);
+		}
+	}
+}
+
+/*
+ * The interrupt endpoint of the control interface only carries answers to
+ * commands sent by the driver: it is opened when a transaction starts and
+ * closed autosuspend_delay_ms after the last one, letting usbhid suspend the
+ * interface in between. Transactions are serialized by io_mutex, which is
+ * held from msi_claw_transaction_begin() to msi_claw_transaction_end().
+ */
+static int msi_claw_transaction_begin(struct hid_device *hdev, const char *attr, const char *value)
+{
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+	char action[MSI_CLAW_WRITE_SIZE];
+	int ret, len;
+
+	if (!drvdata->control) {
+		hid_err(hdev, "hid-msi-claw couldn't find control interface\n");
+		return -ENODEV;
+	}
+
+	mutex_lock(&drvdata->io_mutex);
+
+	if (drvdata->suspended) {
+		ret = -EBUSY;
+		goto msi_claw_transaction_begin_err;
+	}
+
+	cancel_delayed_work(&drvdata->idle_work);
+
+	// answers that came in after their transaction gave up on them
+	msi_claw_flush_read_data(drvdata);
+
+	if (!drvdata->opened) {
+		ret = hid_hw_open(hdev);
+		if (ret) {
+			hid_err(hdev, "hid-msi-claw failed to open HID device: %d\n", ret);
+			goto msi_claw_transaction_begin_err;
+		}
+
+		drvdata->opened = true;
+	}
+
+	WRITE_ONCE(drvdata->in_transaction, true);
+
+	// lets a replay of the capture issue the same request
+	if (value != NULL)
+		len = scnprintf(action, sizeof(action), "%s=%s", attr, value);
+	else
+		len = scnprintf(action, sizeof(action), "%s", attr);
+	msi_claw_capture(drvdata, MSI_CLAW_CAPTURE_ACTION, (const uint8_t *)action, len, ktime_get());
+
+	return 0;
+
+msi_claw_transaction_begin_err:
+	mutex_unlock(&drvdata->io_mutex);
+
+	return ret;
+}
+
+static void msi_claw_transaction_end(struct hid_device *hdev)
+{
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+
+	WRITE_ONCE(drvdata->in_transaction, false);
+
+	if (!drvdata->monitor)
+		schedule_delayed_work(&drvdata->idle_work, msecs_to_jiffies(autosuspend_delay_ms));
+
+	mutex_unlock(&drvdata->io_mutex);
+}
+
+// must be called with io_mutex held
+static void msi_claw_close(struct msi_claw_drvdata *drvdata)
+{
+	if (!drvdata->opened)
+		return;
+
+	hid_hw_close(drvdata->hdev);
+	drvdata->opened = false;
+
+	// nobody is waiting for what the device may have sent meanwhile
+	msi_claw_flush_read_data(drvdata);
+}
+
+static void msi_claw_idle_work(struct work_struct *work)
+{
+	struct msi_claw_drvdata *drvdata = container_of(to_delayed_work(work),
+		struct msi_claw_drvdata, idle_work);
+
+	guard(mutex)(&drvdata->io_mutex);
+
+	msi_claw_close(drvdata);
+}
+
+// called whenever the device state is known, from a transaction or an unsolicited report
+static void msi_claw_update_status(struct hid_device *hdev, const struct msi_claw_control_status *status)
+{
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+
+	if ((READ_ONCE(drvdata->control->gamepad_mode) == status->gamepad_mode) &&
+	    (READ_ONCE(drvdata->control->mkeys_function) == status->mkeys_function))
+		return;
+
+	WRITE_ONCE(drvdata->control->gamepad_mode, status->gamepad_mode);
+	WRITE_ONCE(drvdata->control->mkeys_function, status->mkeys_function);
+
+	schedule_work(&drvdata->notify_work);
+}
+
 static int msi_claw_raw_event_control(struct hid_device *hdev, struct msi_claw_drvdata *drvdata,
 	struct hid_report *report, uint8_t *data, int size)
 {
 	struct msi_claw_read_data **list = NULL;
 	struct msi_claw_read_data *node = NULL;
-	uint8_t *buffer;
-	int ret, i;
+	uint8_t *buffer = NULL;
+	int ret = 0, i;
 
 	if (size != MSI_CLAW_READ_SIZE) {
 		//hid_err(hdev, "hid-msi-claw got unknown %d bytes\n", size);
@@ -221,7 +759,21 @@ static int msi_claw_raw_event_control(struct hid_device *hdev, struct msi_claw_d
 		goto msi_claw_raw_event_control_err;
 	}
 
-	buffer = kmemdup(data, size, GFP_KERNEL);
+	// the device reports mode changes made with its own buttons on its own
+	if ((!READ_ONCE(drvdata->in_transaction)) && (data[4] == (uint8_t)MSI_CLAW_COMMAND_TYPE_GAMEPAD_MODE_ACK)) {
+		struct msi_claw_control_status status = {
+			.gamepad_mode = (enum msi_claw_gamepad_mode)data[5],
+			.mkeys_function = (enum msi_claw_mkeys_function)data[6],
+		};
+
+		if ((data[5] < MSI_CLAW_GAMEPAD_MODE_MAX) && (data[6] < MSI_CLAW_MKEY_FUNCTION_MAX))
+			msi_claw_update_status(hdev, &status);
+
+		return 0;
+	}
+
+	// called from the urb completion: no sleeping from here on
+	buffer = kmemdup(data, size, GFP_ATOMIC);
 	if (buffer == NULL) {
 		ret = -ENOMEM;
 		hid_err(hdev, "hid-msi-claw failed to alloc %d bytes for read buffer: %d\n", size, ret);
@@ -231,10 +783,11 @@ static int msi_claw_raw_event_control(struct hid_device *hdev, struct msi_claw_d
 	struct msi_claw_read_data evt = {
 		.data = buffer,
 		.size = size,
+		.timestamp = drvdata->report_arrival,
 		.next = NULL,
 	};
 
-	node = kmemdup(&evt, sizeof(evt), GFP_KERNEL);
+	node = kmemdup(&evt, sizeof(evt), GFP_ATOMIC);
 	if (!node) {
 		ret = -ENOMEM;
 		kfree(buffer);
@@ -242,7 +795,7 @@ static int msi_claw_raw_event_control(struct hid_device *hdev, struct msi_claw_d
 		goto msi_claw_raw_event_control_err;
 	}
 
-	scoped_guard(mutex, &drvdata->read_data_mutex) {
+	scoped_guard(spinlock_irqsave, &drvdata->read_data_lock) {
 		list = &drvdata->read_data;
 		for (i = 0; (i < 32) && (*list != NULL); i++)
 			list = &(*list)->next;
@@ -256,7 +809,9 @@ static int msi_claw_raw_event_control(struct hid_device *hdev, struct msi_claw_d
 		*list = node;
 	}
 
-	hid_notice(hdev, "hid-msi-claw received %d bytes, cmd: 0x%02x\n", size, buffer[4]);
+	wake_up(&drvdata->read_wait);
+
+	hid_dbg(hdev, "hid-msi-claw received %d bytes, cmd: 0x%02x\n", size, buffer[4]);
 
 	return 0;
 
@@ -270,16 +825,148 @@ msi_claw_raw_event_control_err:
 	return ret;
 }
 
+static void msi_claw_latency_record(struct msi_claw_drvdata *drvdata)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), drvdata->report_arrival));
+
+	drvdata->latency_hist[min_t(int, fls64(ns), MSI_CLAW_LATENCY_BUCKETS - 1)]++;
+	drvdata->latency_max_ns = max(drvdata->latency_max_ns, ns);
+	drvdata->latency_count++;
+}
+
 static int msi_claw_raw_event(struct hid_device *hdev, struct hid_report *report, uint8_t *data, int size)
 {
 	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+	int ret;
 
-	if (!drvdata->control) {
-		hid_notice(hdev, "hid-msi-claw event not from control interface: ignoring\n");
+	drvdata->report_arrival = ktime_get();
+
+	msi_claw_capture(drvdata, MSI_CLAW_CAPTURE_IN, data, size, drvdata->report_arrival);
+
+	// input interfaces are accounted for once the report has been parsed in msi_claw_report()
+	if (!drvdata->control)
+		return 0;
+
+	ret = msi_claw_raw_event_control(hdev, drvdata, report, data, size);
+
+	msi_claw_latency_record(drvdata);
+
+	return ret;
+}
+
+static void msi_claw_report(struct hid_device *hdev, struct hid_report *report)
+{
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+	struct hid_input *hidinput;
+
+	if (drvdata->control)
+		return;
+
+	// set before the input core syncs the frame of this report
+	if (latency_timestamps)
+		list_for_each_entry(hidinput, &hdev->inputs, list)
+			input_set_timestamp(hidinput->input, drvdata->report_arrival);
+
+	msi_claw_latency_record(drvdata);
+}
+
+/*
+ * M-keys bound to a macro slot start its playback on press and are never
+ * reported themselves. Playback is started from a work item as it has to
+ * wait for a running macro to be stopped.
+ */
+static bool msi_claw_macro_trigger(struct hid_device *hdev, unsigned int code, __s32 value)
+{
+	struct device *parent = msi_claw_parent(hdev);
+	struct msi_claw_drvdata *control;
+	bool triggered = false;
+	unsigned int slot;
+
+	if (code == KEY_RESERVED)
+		return false;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(control, &msi_claw_controls, control_node) {
+		if (control->parent != parent)
+			continue;
+
+		for (slot = 0; slot < MSI_CLAW_MACRO_SLOTS; slot++) {
+			if (READ_ONCE(control->macro_trigger[slot]) != code)
+				continue;
+
+			if (value == 0) {
+				clear_bit(slot, &control->macro_held);
+			} else if (!test_and_set_bit(slot, &control->macro_held)) {
+				WRITE_ONCE(control->macro_pending, slot);
+				queue_work(system_highpri_wq, &control->macro_work);
+			}
+
+			triggered = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return triggered;
+}
+
+static int msi_claw_event(struct hid_device *hdev, struct hid_field *field,
+	struct hid_usage *usage, __s32 value)
+{
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+	const struct msi_claw_remap *remap;
+	unsigned int code = usage->code;
+
+	if ((usage->type != EV_KEY) || (!field->hidinput))
 		return 0;
+
+	if (msi_claw_macro_trigger(hdev, usage->code, value))
+		return 1;
+
+	/*
+	 * Every usage comes with each report, pressed or not: the code is
+	 * chosen on press and kept until the release, whatever happens to
+	 * the remap table meanwhile.
+	 */
+	if (value != 0) {
+		if (drvdata->remap_pressed[usage->code] == 0) {
+			rcu_read_lock();
+			remap = rcu_dereference(drvdata->remap);
+			if (remap != NULL)
+				code = remap->codes[usage->code];
+			rcu_read_unlock();
+
+			// the target has to exist on the input device of the original key
+			if (!test_bit(code, field->hidinput->input->keybit))
+				code = usage->code;
+
+			drvdata->remap_pressed[usage->code] = code;
+			if (code != usage->code)
+				drvdata->remap_holders[code]++;
+		}
+
+		code = drvdata->remap_pressed[usage->code];
+		if (code == usage->code)
+			return 0;
+
+		input_event(field->hidinput->input, EV_KEY, code, value);
+
+		return 1;
+	}
+
+	code = drvdata->remap_pressed[usage->code];
+	drvdata->remap_pressed[usage->code] = 0;
+
+	if ((code != 0) && (code != usage->code)) {
+		// released once neither another remapped key nor its own one holds it
+		if ((--drvdata->remap_holders[code] == 0) && (drvdata->remap_pressed[code] != code))
+			input_event(field->hidinput->input, EV_KEY, code, 0);
+
+		return 1;
 	}
 
-	return msi_claw_raw_event_control(hdev, drvdata, report, data, size);
+	// a key held through a remap of another one stays pressed
+	return (drvdata->remap_holders[usage->code] != 0) ? 1 : 0;
 }
 
 static int msi_claw_await_ack(struct hid_device *hdev)
@@ -294,7 +981,7 @@ static int msi_claw_await_ack(struct hid_device *hdev)
 		goto msi_claw_await_ack_err;
 	}
 
-	ret = msi_claw_read(hdev, buffer, MSI_CLAW_READ_SIZE, 1000);
+	ret = msi_claw_read(hdev, buffer, MSI_CLAW_READ_SIZE);
 	if (ret < 0) {
 		hid_err(hdev, "hid-msi-claw failed to read ack: %d\n", ret);
 		goto msi_claw_await_ack_err;
@@ -344,10 +1031,12 @@ static int sync_to_rom(struct hid_device *hdev)
 	}
 
 	// the sync to rom also triggers two ack
-	ret = msi_claw_await_ack(hdev);
-	if (ret) {
-		hid_err(hdev, "hid-msi-claw failed to await second ack: %d\n", ret);
-		goto sync_to_rom_err;
+	if (drvdata->quirks->double_ack) {
+		ret = msi_claw_await_ack(hdev);
+		if (ret) {
+			hid_err(hdev, "hid-msi-claw failed to await second ack: %d\n", ret);
+			goto sync_to_rom_err;
+		}
 	}
 
 	ret = 0;
@@ -387,6 +1076,26 @@ msi_claw_reset_device_err:
 	return ret;
 }
 
+static void msi_claw_notify_work(struct work_struct *work)
+{
+	struct msi_claw_drvdata *drvdata = container_of(work, struct msi_claw_drvdata, notify_work);
+	struct hid_device *hdev = drvdata->hdev;
+	int mode = (int)READ_ONCE(drvdata->control->gamepad_mode);
+	int function = (int)READ_ONCE(drvdata->control->mkeys_function);
+	char gamepad_mode[64], mkeys_function[64];
+	char *envp[] = { gamepad_mode, mkeys_function, NULL };
+
+	snprintf(gamepad_mode, sizeof(gamepad_mode), "MSI_CLAW_GAMEPAD_MODE=%s",
+		(mode < ARRAY_SIZE(gamepad_mode_map)) ? gamepad_mode_map[mode].name : "unknown");
+	snprintf(mkeys_function, sizeof(mkeys_function), "MSI_CLAW_MKEYS_FUNCTION=%s",
+		(function < ARRAY_SIZE(mkeys_function_map)) ? mkeys_function_map[function] : "unknown");
+
+	sysfs_notify(&hdev->dev.kobj, NULL, "gamepad_mode_current");
+	sysfs_notify(&hdev->dev.kobj, NULL, "mkeys_function_current");
+
+	kobject_uevent_env(&hdev->dev.kobj, KOBJ_CHANGE, envp);
+}
+
 static int msi_claw_read_gamepad_mode(struct hid_device *hdev,
 	struct msi_claw_control_status *status)
 {
@@ -403,7 +1112,7 @@ static int msi_claw_read_gamepad_mode(struct hid_device *hdev,
 		goto msi_claw_read_gamepad_mode_err;
 	}
 
-	ret = msi_claw_read(hdev, buffer, MSI_CLAW_READ_SIZE, 50);
+	ret = msi_claw_read(hdev, buffer, MSI_CLAW_READ_SIZE);
 	if (ret != MSI_CLAW_READ_SIZE) {
 		hid_err(hdev, "hid-msi-claw failed to read: %d\n", ret);
 		ret = -EINVAL;
@@ -427,6 +1136,8 @@ static int msi_claw_read_gamepad_mode(struct hid_device *hdev,
 	status->gamepad_mode = (enum msi_claw_gamepad_mode)buffer[5];
 	status->mkeys_function = (enum msi_claw_mkeys_function)buffer[6];
 
+	msi_claw_update_status(hdev, status);
+
 	ret = 0;
 
 msi_claw_read_gamepad_mode_err:
@@ -464,23 +1175,27 @@ static int msi_claw_switch_gamepad_mode(struct hid_device *hdev,
 	}
 
 	// the gamepad mode switch mode triggers two ack
-	ret = msi_claw_await_ack(hdev);
-	if (ret) {
-		hid_err(hdev, "hid-msi-claw failed to await second ack: %d\n", ret);
-		goto msi_claw_switch_gamepad_mode_err;
+	if (drvdata->quirks->double_ack) {
+		ret = msi_claw_await_ack(hdev);
+		if (ret) {
+			hid_err(hdev, "hid-msi-claw failed to await second ack: %d\n", ret);
+			goto msi_claw_switch_gamepad_mode_err;
+		}
 	}
 
 	// check the new mode as official application does
-	ret = msi_claw_read_gamepad_mode(hdev, &check_status);
-	if (ret) {
-		hid_err(hdev, "hid-msi-claw failed to read status: %d\n", ret);
-		goto msi_claw_switch_gamepad_mode_err;
-	}
+	if (drvdata->quirks->verify_switch) {
+		ret = msi_claw_read_gamepad_mode(hdev, &check_status);
+		if (ret) {
+			hid_err(hdev, "hid-msi-claw failed to read status: %d\n", ret);
+			goto msi_claw_switch_gamepad_mode_err;
+		}
 
-	if (memcmp((const void *)&check_status, (const void *)status, sizeof(*status))) {
-		hid_err(hdev, "hid-msi-claw current status and target one are different\n");
-		ret = -EIO;
-		goto msi_claw_switch_gamepad_mode_err;
+		if (memcmp((const void *)&check_status, (const void *)status, sizeof(*status))) {
+			hid_err(hdev, "hid-msi-claw current status and target one are different\n");
+			ret = -EIO;
+			goto msi_claw_switch_gamepad_mode_err;
+		}
 	}
 
 	// the device now sends back 03 00 00 00 00 00 00 00 00
@@ -492,6 +1207,8 @@ static int msi_claw_switch_gamepad_mode(struct hid_device *hdev,
 		return ret;
 	}
 
+	msi_claw_update_status(hdev, status);
+
 msi_claw_switch_gamepad_mode_err:
 	return ret;
 }
@@ -499,14 +1216,23 @@ msi_claw_switch_gamepad_mode_err:
 static ssize_t reset_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
 	struct hid_device *hdev = to_hid_device(dev);
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
 	int ret;
 
+	ret = msi_claw_transaction_begin(hdev, attr->attr.name, "1");
+	if (ret)
+		goto reset_store_err;
+
 	ret = msi_claw_reset_device(hdev);
+	msi_claw_transaction_end(hdev);
 	if (ret < 0) {
 		hid_err(hdev, "hid-msi-claw error resetting device: %d\n", ret);
 		goto reset_store_err;
 	}
 
+	// the device may come back in another mode: have userspace read it again
+	schedule_work(&drvdata->notify_work);
+
 	return count;
 
 reset_store_err:
@@ -514,13 +1240,20 @@ reset_store_err:
 }
 static DEVICE_ATTR_WO(reset);
 
+static bool msi_claw_gamepad_mode_available(const struct msi_claw_drvdata *drvdata,
+	enum msi_claw_gamepad_mode mode)
+{
+	return gamepad_mode_debug || (drvdata->quirks->gamepad_modes & BIT(mode));
+}
+
 static ssize_t gamepad_mode_available_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(to_hid_device(dev));
 	int i, ret = 0;
 	int len = ARRAY_SIZE(gamepad_mode_map);
 
 	for (i = 0; i < len; i++) {
-		if (!gamepad_mode_map[i].available)
+		if (!msi_claw_gamepad_mode_available(drvdata, i))
 			continue;
 
 		ret += sysfs_emit_at(buf, ret, "%s", gamepad_mode_map[i].name);
@@ -540,7 +1273,12 @@ static ssize_t gamepad_mode_current_show(struct device *dev, struct device_attri
 	struct msi_claw_control_status status;
 	int ret;
 
+	ret = msi_claw_transaction_begin(hdev, attr->attr.name, NULL);
+	if (ret)
+		return ret;
+
 	ret = msi_claw_read_gamepad_mode(hdev, &status);
+	msi_claw_transaction_end(hdev);
 	if (ret) {
 		hid_err(hdev, "hid-msi-claw error reaging the gamepad mode: %d\n", ret);
 		return ret;
@@ -577,7 +1315,7 @@ static ssize_t gamepad_mode_current_store(struct device *dev, struct device_attr
 		input[count-1] = '\0';
 
 	for (size_t i = 0; i < (size_t)new_gamepad_mode; i++)
-		if ((!strcmp(input, gamepad_mode_map[i].name)) && (gamepad_mode_map[i].available))
+		if ((!strcmp(input, gamepad_mode_map[i].name)) && (msi_claw_gamepad_mode_available(drvdata, i)))
 			new_gamepad_mode = (enum msi_claw_gamepad_mode)i;
 
 	kfree(input);
@@ -589,7 +1327,13 @@ static ssize_t gamepad_mode_current_store(struct device *dev, struct device_attr
 	}
 
 	status.gamepad_mode = new_gamepad_mode;
+
+	ret = msi_claw_transaction_begin(hdev, attr->attr.name, gamepad_mode_map[new_gamepad_mode].name);
+	if (ret)
+		goto gamepad_mode_current_store_err;
+
 	ret = msi_claw_switch_gamepad_mode(hdev, &status);
+	msi_claw_transaction_end(hdev);
 	if (ret) {
 		hid_err(hdev, "Error changing gamepad mode: %d\n", (int)ret);
 		goto gamepad_mode_current_store_err;
@@ -623,8 +1367,14 @@ static ssize_t mkeys_function_current_show(struct device *dev, struct device_att
 {
 	struct hid_device *hdev = to_hid_device(dev);
 	struct msi_claw_control_status status;
-	int ret = msi_claw_read_gamepad_mode(hdev, &status);
+	int ret;
 
+	ret = msi_claw_transaction_begin(hdev, attr->attr.name, NULL);
+	if (ret)
+		return ret;
+
+	ret = msi_claw_read_gamepad_mode(hdev, &status);
+	msi_claw_transaction_end(hdev);
 	if (ret) {
 		hid_err(hdev, "hid-msi-claw error reaging the gamepad mode: %d\n", ret);
 		return ret;
@@ -669,7 +1419,13 @@ static ssize_t mkeys_function_current_store(struct device *dev, struct device_at
 	}
 
 	status.mkeys_function = new_mkeys_function;
+
+	err = msi_claw_transaction_begin(hdev, attr->attr.name, mkeys_function_map[new_mkeys_function]);
+	if (err)
+		return err;
+
 	err = msi_claw_switch_gamepad_mode(hdev, &status);
+	msi_claw_transaction_end(hdev);
 	if (err) {
 		hid_err(hdev, "Error changing mkeys function: %d\n", (int)err);
 		return err;
@@ -679,32 +1435,616 @@ static ssize_t mkeys_function_current_store(struct device *dev, struct device_at
 }
 static DEVICE_ATTR_RW(mkeys_function_current);
 
-static int __maybe_unused msi_claw_resume(struct hid_device *hdev)
+static enum hrtimer_restart msi_claw_macro_timer_fn(struct hrtimer *timer)
 {
-	int ret;
-	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
-	struct msi_claw_control_status status = {
-		.gamepad_mode = drvdata->control->gamepad_mode,
-		.mkeys_function = drvdata->control->mkeys_function,
-	};
+	struct msi_claw_drvdata *drvdata = container_of(timer, struct msi_claw_drvdata, macro_timer);
+	const struct msi_claw_macro *macro = drvdata->macro_playing;
+	const struct msi_claw_macro_event *evt;
+
+	// emit the due event and every following one that has no delay
+	do {
+		evt = &macro->events[drvdata->macro_pos++];
+		input_event(drvdata->input, EV_KEY, le16_to_cpu(evt->code), evt->value);
+	} while ((drvdata->macro_pos < macro->count) && (!macro->events[drvdata->macro_pos].delay_us));
+
+	input_sync(drvdata->input);
+
+	if (drvdata->macro_pos >= macro->count) {
+		drvdata->macro_playing = NULL;
+		return HRTIMER_NORESTART;
+	}
+
+	hrtimer_forward_now(timer, us_to_ktime(le32_to_cpu(macro->events[drvdata->macro_pos].delay_us)));
+
+	return HRTIMER_RESTART;
+}
+
+// must be called with macro_mutex held
+static void msi_claw_macro_stop(struct msi_claw_drvdata *drvdata)
+{
+	unsigned int code;
+
+	hrtimer_cancel(&drvdata->macro_timer);
+
+	if (drvdata->macro_playing == NULL)
+		return;
+
+	drvdata->macro_playing = NULL;
+
+	// release whatever the interrupted macro left pressed
+	for_each_set_bit(code, drvdata->input->key, KEY_CNT)
+		input_report_key(drvdata->input, code, 0);
+
+	input_sync(drvdata->input);
+}
+
+static int msi_claw_macro_play(struct hid_device *hdev, unsigned int slot)
+{
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+	const struct msi_claw_macro *macro;
+
+	if (!drvdata->input) {
+		hid_err(hdev, "hid-msi-claw couldn't find macro input device\n");
+		return -ENODEV;
+	}
+
+	if (slot >= MSI_CLAW_MACRO_SLOTS)
+		return -EINVAL;
+
+	guard(mutex)(&drvdata->macro_mutex);
+
+	msi_claw_macro_stop(drvdata);
+
+	macro = drvdata->macros[slot];
+	if (macro == NULL)
+		return -ENOENT;
+
+	drvdata->macro_playing = macro;
+	drvdata->macro_pos = 0;
+	hrtimer_start(&drvdata->macro_timer, us_to_ktime(le32_to_cpu(macro->events[0].delay_us)),
+		HRTIMER_MODE_REL);
+
+	return 0;
+}
+
+static void msi_claw_macro_work(struct work_struct *work)
+{
+	struct msi_claw_drvdata *drvdata = container_of(work, struct msi_claw_drvdata, macro_work);
+	unsigned int slot = READ_ONCE(drvdata->macro_pending);
+	int ret;
+
+	ret = msi_claw_macro_play(drvdata->hdev, slot);
+	if (ret)
+		hid_err(drvdata->hdev, "hid-msi-claw error playing macro %u: %d\n", slot, ret);
+}
+
+static ssize_t macro_write(struct file *filp, struct kobject *kobj,
+	MSI_CLAW_BIN_ATTR_CONST struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct hid_device *hdev = to_hid_device(kobj_to_dev(kobj));
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+	const struct msi_claw_macro_header *header = (const struct msi_claw_macro_header *)buf;
+	const struct msi_claw_macro_event *events = (const struct msi_claw_macro_event *)&header[1];
+	struct msi_claw_macro *macro = NULL;
+	int i, events_count;
 
-	// TODO: clear out events list here (or in suspend?)
+	if ((off != 0) || (count < sizeof(*header))) {
+		hid_err(hdev, "hid-msi-claw macro must be written in a single chunk\n");
+		return -EINVAL;
+	}
+
+	events_count = le16_to_cpu(header->count);
+	if (header->slot >= MSI_CLAW_MACRO_SLOTS) {
+		hid_err(hdev, "hid-msi-claw invalid macro slot: %u\n", header->slot);
+		return -EINVAL;
+	} else if (events_count > MSI_CLAW_MACRO_MAX_EVENTS) {
+		hid_err(hdev, "hid-msi-claw too many macro events: %d\n", events_count);
+		return -E2BIG;
+	} else if (count != sizeof(*header) + (events_count * sizeof(*events))) {
+		hid_err(hdev, "hid-msi-claw macro size mismatch: %zu bytes for %d events\n", count, events_count);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < events_count; i++) {
+		if ((le16_to_cpu(events[i].code) >= KEY_CNT) ||
+		    (!test_bit(le16_to_cpu(events[i].code), drvdata->input->keybit)) ||
+		    (events[i].value > 2)) {
+			hid_err(hdev, "hid-msi-claw invalid macro event %d: code %u value %u\n",
+				i, le16_to_cpu(events[i].code), events[i].value);
+			return -EINVAL;
+		}
+	}
+
+	// an empty macro just clears the slot
+	if (events_count) {
+		macro = kzalloc(struct_size(macro, events, events_count), GFP_KERNEL);
+		if (!macro)
+			return -ENOMEM;
+
+		macro->count = events_count;
+		memcpy(macro->events, events, events_count * sizeof(*events));
+	}
+
+	scoped_guard(mutex, &drvdata->macro_mutex) {
+		msi_claw_macro_stop(drvdata);
+		kfree(drvdata->macros[header->slot]);
+		drvdata->macros[header->slot] = macro;
+	}
+
+	return count;
+}
+static BIN_ATTR_WO(macro, 0);
+
+static ssize_t macro_play_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct hid_device *hdev = to_hid_device(dev);
+	unsigned int slot;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &slot);
+	if (ret)
+		return ret;
+
+	ret = msi_claw_macro_play(hdev, slot);
+	if (ret) {
+		hid_err(hdev, "hid-msi-claw error playing macro %u: %d\n", slot, ret);
+		return ret;
+	}
+
+	return count;
+}
+static DEVICE_ATTR_WO(macro_play);
+
+static ssize_t macro_trigger_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(to_hid_device(dev));
+	int i, ret = 0;
+
+	for (i = 0; i < MSI_CLAW_MACRO_SLOTS; i++)
+		ret += sysfs_emit_at(buf, ret, "%s%u", i ? " " : "", READ_ONCE(drvdata->macro_trigger[i]));
+	ret += sysfs_emit_at(buf, ret, "\n");
+
+	return ret;
+}
+
+// "<slot> <key code>" binds the M-key reporting that code to the slot, code 0 unbinds it
+static ssize_t macro_trigger_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct hid_device *hdev = to_hid_device(dev);
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+	unsigned int slot, code;
+
+	if ((sscanf(buf, "%u %u", &slot, &code) != 2) || (slot >= MSI_CLAW_MACRO_SLOTS) || (code >= KEY_CNT)) {
+		hid_err(hdev, "hid-msi-claw invalid macro trigger: expected <slot> <key code>\n");
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(drvdata->macro_trigger[slot], code);
+	// the release of the key bound before would never clear it
+	clear_bit(slot, &drvdata->macro_held);
+
+	return count;
+}
+static DEVICE_ATTR_RW(macro_trigger);
+
+static int msi_claw_macro_input_init(struct hid_device *hdev)
+{
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+	struct input_dev *input;
+	unsigned int code;
+
+	input = devm_input_allocate_device(&hdev->dev);
+	if (!input)
+		return -ENOMEM;
+
+	input->name = "MSI Claw Macro";
+	input->phys = hdev->phys;
+	input->uniq = hdev->uniq;
+	input->id.bustype = hdev->bus;
+	input->id.vendor = hdev->vendor;
+	input->id.product = hdev->product;
+	input->id.version = hdev->version;
+
+	// keyboard keys and mouse buttons only: gamepad buttons would make
+	// userspace classify the macro device as a joystick
+	for (code = KEY_ESC; code < BTN_MISC; code++)
+		input_set_capability(input, EV_KEY, code);
+	for (code = BTN_LEFT; code <= BTN_TASK; code++)
+		input_set_capability(input, EV_KEY, code);
+	for (code = KEY_OK; code < KEY_CNT; code++)
+		input_set_capability(input, EV_KEY, code);
+
+	drvdata->input = input;
+
+	return input_register_device(input);
+}
+
+static bool msi_claw_remap_supported(struct hid_device *hdev, unsigned int from, unsigned int to)
+{
+	struct hid_input *hidinput;
+	bool found = false;
+
+	// remapped events are reported on the input device of the original one,
+	// so every input device reporting the key needs the target as well
+	list_for_each_entry(hidinput, &hdev->inputs, list) {
+		if (!test_bit(from, hidinput->input->keybit))
+			continue;
+
+		if (!test_bit(to, hidinput->input->keybit))
+			return false;
+
+		found = true;
+	}
+
+	return found;
+}
+
+// must be called with remap_mutex held
+static void msi_claw_remap_set(struct msi_claw_drvdata *drvdata, unsigned int profile,
+	struct msi_claw_remap *remap)
+{
+	struct msi_claw_remap *old = drvdata->remap_profiles[profile];
+
+	drvdata->remap_profiles[profile] = remap;
+	if (profile == drvdata->remap_profile)
+		rcu_assign_pointer(drvdata->remap, remap);
+
+	if (old != NULL)
+		kfree_rcu(old, rcu);
+}
+
+static ssize_t button_remap_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hdev = to_hid_device(dev);
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+	const struct msi_claw_remap *remap;
+	int i, ret = 0;
+
+	guard(mutex)(&drvdata->remap_mutex);
+
+	remap = drvdata->remap_profiles[drvdata->remap_profile];
+	if (remap != NULL) {
+		for (i = 0; i < KEY_CNT; i++) {
+			if (remap->codes[i] == i)
+				continue;
+
+			ret += sysfs_emit_at(buf, ret, "%s%d:%u", ret ? " " : "", i, remap->codes[i]);
+		}
+	}
+	ret += sysfs_emit_at(buf, ret, "\n");
+
+	return ret;
+}
+
+static ssize_t button_remap_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct hid_device *hdev = to_hid_device(dev);
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+	struct msi_claw_remap *remap;
+	unsigned int from, to;
+	char *input, *cur, *token;
+	bool identity = true;
+	ssize_t ret;
+	int i;
+
+	remap = kzalloc(sizeof(*remap), GFP_KERNEL);
+	if (!remap)
+		return -ENOMEM;
+
+	for (i = 0; i < KEY_CNT; i++)
+		remap->codes[i] = i;
+
+	input = kmemdup_nul(buf, count, GFP_KERNEL);
+	if (!input) {
+		ret = -ENOMEM;
+		goto button_remap_store_err;
+	}
+
+	// whitespace separated list of "from:to" key code pairs
+	cur = input;
+	while ((token = strsep(&cur, " \t\n")) != NULL) {
+		if (!*token)
+			continue;
+
+		if ((sscanf(token, "%u:%u", &from, &to) != 2) || (from >= KEY_CNT) || (to >= KEY_CNT)) {
+			hid_err(hdev, "hid-msi-claw invalid remap entry: %s\n", token);
+			ret = -EINVAL;
+			goto button_remap_store_err;
+		} else if (!msi_claw_remap_supported(hdev, from, to)) {
+			hid_err(hdev, "hid-msi-claw unsupported remap: %u to %u\n", from, to);
+			ret = -EINVAL;
+			goto button_remap_store_err;
+		}
+
+		remap->codes[from] = to;
+	}
+
+	kfree(input);
+
+	for (i = 0; (i < KEY_CNT) && identity; i++)
+		identity = (remap->codes[i] == i);
+
+	// an empty (or identity) list clears the profile
+	if (identity) {
+		kfree(remap);
+		remap = NULL;
+	}
+
+	scoped_guard(mutex, &drvdata->remap_mutex)
+		msi_claw_remap_set(drvdata, drvdata->remap_profile, remap);
+
+	return count;
+
+button_remap_store_err:
+	kfree(input);
+	kfree(remap);
+
+	return ret;
+}
+static DEVICE_ATTR_RW(button_remap);
+
+static ssize_t button_remap_profile_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct hid_device *hdev = to_hid_device(dev);
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(drvdata->remap_profile));
+}
+
+static ssize_t button_remap_profile_store(struct device *dev, struct device_attribute *attr,
+	const char *buf, size_t count)
+{
+	struct hid_device *hdev = to_hid_device(dev);
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+	unsigned int profile;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &profile);
+	if (ret)
+		return ret;
+
+	if (profile >= MSI_CLAW_REMAP_PROFILES) {
+		hid_err(hdev, "hid-msi-claw invalid remap profile: %u\n", profile);
+		return -EINVAL;
+	}
+
+	scoped_guard(mutex, &drvdata->remap_mutex) {
+		WRITE_ONCE(drvdata->remap_profile, profile);
+		rcu_assign_pointer(drvdata->remap, drvdata->remap_profiles[profile]);
+	}
+
+	return count;
+}
+static DEVICE_ATTR_RW(button_remap_profile);
+
+static void msi_claw_resume_work(struct work_struct *work)
+{
+	struct msi_claw_drvdata *drvdata = container_of(work, struct msi_claw_drvdata, resume_work);
+	struct hid_device *hdev = drvdata->hdev;
+	struct msi_claw_control_status status;
+	int ret;
 
 	// wait for device to be ready
-	msleep(500);
+	msleep(drvdata->quirks->resume_delay_ms);
+
+	// a new system sleep may have started meanwhile
+	scoped_guard(mutex, &drvdata->io_mutex) {
+		if (!drvdata->resuming)
+			return;
+
+		drvdata->resuming = false;
+		drvdata->suspended = false;
+	}
+
+	status.gamepad_mode = drvdata->control->gamepad_mode;
+	status.mkeys_function = drvdata->control->mkeys_function;
+
+	ret = msi_claw_transaction_begin(hdev, "resume", NULL);
+	if (ret)
+		return;
 
 	ret = msi_claw_switch_gamepad_mode(hdev, &status);
+	msi_claw_transaction_end(hdev);
 	if (ret) {
 		hid_err(hdev, "Error changing gamepad mode: %d\n", (int)ret);
-		goto msi_claw_resume_err;
+		return;
 	}
 
+	// state may have changed while suspended, even though the cache did not
+	schedule_work(&drvdata->notify_work);
+
 	// TODO: retry until this works?
+}
+
+/*
+ * usbhid calls these for autosuspend too: that only happens once the
+ * control interface is closed, so there is nothing to do about it.
+ */
+static int __maybe_unused msi_claw_suspend(struct hid_device *hdev, pm_message_t message)
+{
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+
+	if ((!drvdata->control) || PMSG_IS_AUTO(message))
+		return 0;
+
+	drvdata->system_sleep = true;
+
+	scoped_guard(mutex, &drvdata->macro_mutex)
+		msi_claw_macro_stop(drvdata);
+
+	// waits for the transaction in flight, new ones are refused until resumed
+	cancel_work(&drvdata->resume_work);
+	scoped_guard(mutex, &drvdata->io_mutex) {
+		drvdata->resuming = false;
+		drvdata->suspended = true;
+		cancel_delayed_work(&drvdata->idle_work);
+		msi_claw_close(drvdata);
+	}
 
 	return 0;
+}
 
-msi_claw_resume_err:
-	return ret;
+/*
+ * Also called on every runtime resume, possibly from hid_hw_open() of a
+ * transaction holding io_mutex: never take it here, the mode is restored
+ * from a work item after system sleep only.
+ */
+static int __maybe_unused msi_claw_resume(struct hid_device *hdev)
+{
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+
+	if ((!drvdata->control) || (!drvdata->system_sleep))
+		return 0;
+
+	drvdata->system_sleep = false;
+
+	WRITE_ONCE(drvdata->resuming, true);
+	schedule_work(&drvdata->resume_work);
+
+	return 0;
+}
+
+static int msi_claw_latency_show(struct seq_file *s, void *unused)
+{
+	struct msi_claw_drvdata *drvdata = s->private;
+	int i;
+
+	seq_printf(s, "reports: %llu\n", drvdata->latency_count);
+	seq_printf(s, "max_ns: %llu\n", drvdata->latency_max_ns);
+
+	for (i = 0; i < MSI_CLAW_LATENCY_BUCKETS; i++) {
+		if (!drvdata->latency_hist[i])
+			continue;
+
+		seq_printf(s, "%llu-%llu ns: %llu\n", i ? BIT_ULL(i - 1) : 0ULL,
+			(i < MSI_CLAW_LATENCY_BUCKETS - 1) ? BIT_ULL(i) - 1 : U64_MAX,
+			drvdata->latency_hist[i]);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(msi_claw_latency);
+
+static int msi_claw_timeouts_show(struct seq_file *s, void *unused)
+{
+	struct msi_claw_drvdata *drvdata = s->private;
+	const struct msi_claw_rtt *rtt;
+	int i, j;
+
+	for (i = 0; i < MSI_CLAW_RTT_MAX; i++) {
+		for (j = 0; j < MSI_CLAW_RTT_STEPS; j++) {
+			rtt = &drvdata->rtt[i][j];
+			seq_printf(s, "%s/%s: srtt %u us rttvar %u us backoff %u timeout %u ms\n", rtt_slot_map[i],
+				j ? "next" : "first", rtt->srtt_us, rtt->rttvar_us, rtt->backoff,
+				msi_claw_timeout_ms(drvdata, i, j));
+		}
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(msi_claw_timeouts);
+
+static int msi_claw_capture_open(struct inode *inode, struct file *file)
+{
+	struct msi_claw_drvdata *drvdata = inode->i_private;
+	const struct msi_claw_capture_header header = {
+		.magic = MSI_CLAW_CAPTURE_MAGIC,
+		.version = cpu_to_le16(MSI_CLAW_CAPTURE_VERSION),
+	};
+	const struct msi_claw_capture_entry *entry;
+	struct msi_claw_capture_entry *snapshot;
+	struct msi_claw_capture_record record;
+	struct msi_claw_capture_snapshot *capture;
+	unsigned long head, pos;
+	uint8_t *buf;
+	size_t len;
+
+	snapshot = kmalloc(sizeof(*snapshot) + drvdata->capture_size, GFP_KERNEL);
+	if (!snapshot)
+		return -ENOMEM;
+
+	capture = kvmalloc(sizeof(*capture) + sizeof(header) +
+		MSI_CLAW_CAPTURE_ENTRIES * (sizeof(record) + drvdata->capture_size), GFP_KERNEL);
+	if (!capture) {
+		kfree(snapshot);
+		return -ENOMEM;
+	}
+
+	buf = capture->data;
+	memcpy(buf, &header, sizeof(header));
+	len = sizeof(header);
+
+	head = atomic_long_read(&drvdata->capture_head);
+	pos = (head > MSI_CLAW_CAPTURE_ENTRIES) ? head - MSI_CLAW_CAPTURE_ENTRIES : 0;
+	for (; pos < head; pos++) {
+		entry = msi_claw_capture_entry(drvdata, pos);
+
+		// skip entries being written or already overwritten by a newer one
+		if (READ_ONCE(entry->seq) != pos + 1)
+			continue;
+		smp_rmb();
+		memcpy(snapshot, entry, sizeof(*snapshot) + drvdata->capture_size);
+		smp_rmb();
+		if (READ_ONCE(entry->seq) != pos + 1)
+			continue;
+
+		record.timestamp_ns = cpu_to_le64(snapshot->timestamp_ns);
+		record.direction = snapshot->direction;
+		record.flags = snapshot->flags;
+		record.size = cpu_to_le16(snapshot->size);
+
+		memcpy(&buf[len], &record, sizeof(record));
+		len += sizeof(record);
+		memcpy(&buf[len], snapshot->data, snapshot->size);
+		len += snapshot->size;
+	}
+
+	kfree(snapshot);
+
+	capture->len = len;
+	file->private_data = capture;
+
+	return 0;
+}
+
+static ssize_t msi_claw_capture_read(struct file *file, char __user *ubuf, size_t count, loff_t *ppos)
+{
+	const struct msi_claw_capture_snapshot *capture = file->private_data;
+
+	return simple_read_from_buffer(ubuf, count, ppos, capture->data, capture->len);
+}
+
+static int msi_claw_capture_release(struct inode *inode, struct file *file)
+{
+	kvfree(file->private_data);
+
+	return 0;
+}
+
+static const struct file_operations msi_claw_capture_fops = {
+	.owner = THIS_MODULE,
+	.open = msi_claw_capture_open,
+	.read = msi_claw_capture_read,
+	.release = msi_claw_capture_release,
+	.llseek = default_llseek,
+};
+
+static void msi_claw_debugfs_init(struct hid_device *hdev)
+{
+#ifdef CONFIG_DEBUG_FS
+	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
+
+	drvdata->debugfs = debugfs_create_dir("msi-claw", hdev->debug_dir);
+	debugfs_create_file("latency", 0444, drvdata->debugfs, drvdata, &msi_claw_latency_fops);
+
+	if (drvdata->control)
+		debugfs_create_file("timeouts", 0444, drvdata->debugfs, drvdata, &msi_claw_timeouts_fops);
+
+	if (drvdata->capture_ring != NULL) {
+		debugfs_create_bool("capture_enabled", 0644, drvdata->debugfs, &drvdata->capture);
+		debugfs_create_file("capture", 0400, drvdata->debugfs, drvdata, &msi_claw_capture_fops);
+	}
+#endif
 }
 
 static int msi_claw_probe(struct hid_device *hdev, const struct hid_device_id *id)
@@ -712,7 +2052,7 @@ static int msi_claw_probe(struct hid_device *hdev, const struct hid_device_id *i
 	int ret;
 	struct msi_claw_drvdata *drvdata;
 
-	if (!hid_is_usb(hdev)) {
+	if ((!hid_is_usb(hdev)) && (!allow_non_usb)) {
 		hid_err(hdev, "hid-msi-claw hid not usb\n");
 		return -ENODEV;
 	}
@@ -723,9 +2063,37 @@ static int msi_claw_probe(struct hid_device *hdev, const struct hid_device_id *i
 		return -ENOMEM;
 	}
 
-	mutex_init(&drvdata->read_data_mutex);
+	spin_lock_init(&drvdata->read_data_lock);
+	init_waitqueue_head(&drvdata->read_wait);
 	drvdata->read_data = NULL;
 	drvdata->control = NULL;
+	drvdata->hdev = hdev;
+	drvdata->quirks = &msi_claw_quirks_default;
+
+	mutex_init(&drvdata->io_mutex);
+	INIT_DELAYED_WORK(&drvdata->idle_work, msi_claw_idle_work);
+	INIT_WORK(&drvdata->notify_work, msi_claw_notify_work);
+	drvdata->opened = false;
+	drvdata->suspended = false;
+	drvdata->monitor = false;
+	drvdata->in_transaction = false;
+	drvdata->system_sleep = false;
+	drvdata->resuming = false;
+	INIT_WORK(&drvdata->resume_work, msi_claw_resume_work);
+
+	mutex_init(&drvdata->macro_mutex);
+	INIT_WORK(&drvdata->macro_work, msi_claw_macro_work);
+	INIT_LIST_HEAD(&drvdata->control_node);
+	drvdata->parent = msi_claw_parent(hdev);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&drvdata->macro_timer, msi_claw_macro_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&drvdata->macro_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	drvdata->macro_timer.function = msi_claw_macro_timer_fn;
+#endif
+
+	mutex_init(&drvdata->remap_mutex);
+	RCU_INIT_POINTER(drvdata->remap, NULL);
 
 	hid_set_drvdata(hdev, drvdata);
 
@@ -741,10 +2109,21 @@ static int msi_claw_probe(struct hid_device *hdev, const struct hid_device_id *i
 		return ret;
 	}
 
-	ret = hid_hw_open(hdev);
-	if (ret) {
-		hid_err(hdev, "hid-msi-claw failed to open HID device: %d\n", ret);
-		goto err_stop_hw;
+	// capture is a debugging aid: the driver works fine without it
+	atomic_long_set(&drvdata->capture_head, 0);
+	drvdata->capture_size = msi_claw_capture_size(hdev);
+	drvdata->capture_ring = kvcalloc(MSI_CLAW_CAPTURE_ENTRIES,
+		msi_claw_capture_stride(drvdata->capture_size), GFP_KERNEL);
+	if (drvdata->capture_ring == NULL)
+		hid_warn(hdev, "hid-msi-claw can't alloc capture ring: capture disabled\n");
+
+	// the control interface is opened on demand by msi_claw_transaction_begin()
+	if (hdev->rdesc[0] != MSI_CLAW_DEVICE_CONTROL_DESC) {
+		ret = hid_hw_open(hdev);
+		if (ret) {
+			hid_err(hdev, "hid-msi-claw failed to open HID device: %d\n", ret);
+			goto err_stop_hw;
+		}
 	}
 
 	if (hdev->rdesc[0] == MSI_CLAW_DEVICE_CONTROL_DESC) {
@@ -787,8 +2166,62 @@ static int msi_claw_probe(struct hid_device *hdev, const struct hid_device_id *i
 			hid_err(hdev, "hid-msi-claw failed to sysfs_create_file dev_attr_reset: %d\n", ret);
 			goto err_dev_attr_reset;
 		}
+
+		ret = msi_claw_macro_input_init(hdev);
+		if (ret) {
+			hid_err(hdev, "hid-msi-claw failed to register macro input device: %d\n", ret);
+			goto err_macro_input;
+		}
+
+		ret = sysfs_create_bin_file(&hdev->dev.kobj, &bin_attr_macro);
+		if (ret) {
+			hid_err(hdev, "hid-msi-claw failed to sysfs_create_bin_file bin_attr_macro: %d\n", ret);
+			goto err_macro_input;
+		}
+
+		ret = sysfs_create_file(&hdev->dev.kobj, &dev_attr_macro_play.attr);
+		if (ret) {
+			hid_err(hdev, "hid-msi-claw failed to sysfs_create_file dev_attr_macro_play: %d\n", ret);
+			goto err_dev_attr_macro_play;
+		}
+
+		ret = sysfs_create_file(&hdev->dev.kobj, &dev_attr_macro_trigger.attr);
+		if (ret) {
+			hid_err(hdev, "hid-msi-claw failed to sysfs_create_file dev_attr_macro_trigger: %d\n", ret);
+			goto err_dev_attr_macro_trigger;
+		}
+
+		scoped_guard(spinlock, &msi_claw_controls_lock)
+			list_add_tail_rcu(&drvdata->control_node, &msi_claw_controls);
+
+		// without it, changes made on the device are only seen when userspace reads the mode
+		if (monitor_mode) {
+			guard(mutex)(&drvdata->io_mutex);
+
+			ret = hid_hw_open(hdev);
+			if (ret) {
+				hid_warn(hdev, "hid-msi-claw can't open control interface for monitoring: %d\n", ret);
+			} else {
+				drvdata->opened = true;
+				drvdata->monitor = true;
+			}
+		}
+	} else if (!list_empty(&hdev->inputs)) {
+		ret = sysfs_create_file(&hdev->dev.kobj, &dev_attr_button_remap.attr);
+		if (ret) {
+			hid_err(hdev, "hid-msi-claw failed to sysfs_create_file dev_attr_button_remap: %d\n", ret);
+			goto err_close;
+		}
+
+		ret = sysfs_create_file(&hdev->dev.kobj, &dev_attr_button_remap_profile.attr);
+		if (ret) {
+			hid_err(hdev, "hid-msi-claw failed to sysfs_create_file dev_attr_button_remap_profile: %d\n", ret);
+			goto err_dev_attr_button_remap_profile;
+		}
 	}
 
+	msi_claw_debugfs_init(hdev);
+
 	return 0;
 
 err_dev_attr_gamepad_mode_current:
@@ -799,10 +2232,26 @@ err_dev_attr_mkeys_function_current:
 	sysfs_remove_file(&hdev->dev.kobj, &dev_attr_mkeys_function_available.attr);
 err_dev_attr_reset:
 	sysfs_remove_file(&hdev->dev.kobj, &dev_attr_mkeys_function_current.attr);
+	goto err_close;
+err_dev_attr_macro_trigger:
+	sysfs_remove_file(&hdev->dev.kobj, &dev_attr_macro_play.attr);
+err_dev_attr_macro_play:
+	sysfs_remove_bin_file(&hdev->dev.kobj, &bin_attr_macro);
+err_macro_input:
+	sysfs_remove_file(&hdev->dev.kobj, &dev_attr_gamepad_mode_available.attr);
+	sysfs_remove_file(&hdev->dev.kobj, &dev_attr_gamepad_mode_current.attr);
+	sysfs_remove_file(&hdev->dev.kobj, &dev_attr_mkeys_function_available.attr);
+	sysfs_remove_file(&hdev->dev.kobj, &dev_attr_mkeys_function_current.attr);
+	sysfs_remove_file(&hdev->dev.kobj, &dev_attr_reset.attr);
+	goto err_close;
+err_dev_attr_button_remap_profile:
+	sysfs_remove_file(&hdev->dev.kobj, &dev_attr_button_remap.attr);
 err_close:
-	hid_hw_close(hdev);
+	if (hdev->rdesc[0] != MSI_CLAW_DEVICE_CONTROL_DESC)
+		hid_hw_close(hdev);
 err_stop_hw:
 	hid_hw_stop(hdev);
+	kvfree(drvdata->capture_ring);
 	return ret;
 }
 
@@ -810,16 +2259,55 @@ static void msi_claw_remove(struct hid_device *hdev)
 {
 	struct msi_claw_drvdata *drvdata = hid_get_drvdata(hdev);
 
+	debugfs_remove_recursive(drvdata->debugfs);
+
 	if (drvdata->control) {
+		scoped_guard(spinlock, &msi_claw_controls_lock)
+			list_del_rcu(&drvdata->control_node);
+		synchronize_rcu();
+
 		sysfs_remove_file(&hdev->dev.kobj, &dev_attr_gamepad_mode_available.attr);
 		sysfs_remove_file(&hdev->dev.kobj, &dev_attr_gamepad_mode_current.attr);
 		sysfs_remove_file(&hdev->dev.kobj, &dev_attr_mkeys_function_available.attr);
 		sysfs_remove_file(&hdev->dev.kobj, &dev_attr_mkeys_function_current.attr);
 		sysfs_remove_file(&hdev->dev.kobj, &dev_attr_reset.attr);
+		sysfs_remove_bin_file(&hdev->dev.kobj, &bin_attr_macro);
+		sysfs_remove_file(&hdev->dev.kobj, &dev_attr_macro_play.attr);
+		sysfs_remove_file(&hdev->dev.kobj, &dev_attr_macro_trigger.attr);
+
+		// nothing can queue it anymore once out of the list
+		cancel_work_sync(&drvdata->macro_work);
+	} else if (!list_empty(&hdev->inputs)) {
+		sysfs_remove_file(&hdev->dev.kobj, &dev_attr_button_remap.attr);
+		sysfs_remove_file(&hdev->dev.kobj, &dev_attr_button_remap_profile.attr);
+	}
+
+	hrtimer_cancel(&drvdata->macro_timer);
+	for (int i = 0; i < MSI_CLAW_MACRO_SLOTS; i++)
+		kfree(drvdata->macros[i]);
+
+	if (drvdata->control) {
+		// the resume work runs a transaction, which schedules the idle one
+		cancel_work_sync(&drvdata->resume_work);
+		cancel_delayed_work_sync(&drvdata->idle_work);
+		scoped_guard(mutex, &drvdata->io_mutex)
+			msi_claw_close(drvdata);
+	} else {
+		hid_hw_close(hdev);
 	}
 
-	hid_hw_close(hdev);
 	hid_hw_stop(hdev);
+
+	// unsolicited reports may schedule it until the device is stopped
+	if (drvdata->control)
+		cancel_work_sync(&drvdata->notify_work);
+
+	// no more events can reach msi_claw_event() past hid_hw_stop()
+	RCU_INIT_POINTER(drvdata->remap, NULL);
+	for (int i = 0; i < MSI_CLAW_REMAP_PROFILES; i++)
+		kfree(drvdata->remap_profiles[i]);
+
+	kvfree(drvdata->capture_ring);
 }
 
 static const struct hid_device_id msi_claw_devices[] = {
@@ -832,9 +2320,12 @@ static struct hid_driver msi_claw_driver = {
 	.name			= "hid-msi-claw",
 	.id_table		= msi_claw_devices,
 	.raw_event		= msi_claw_raw_event,
+	.event			= msi_claw_event,
+	.report			= msi_claw_report,
 	.probe			= msi_claw_probe,
 	.remove			= msi_claw_remove,
 #ifdef CONFIG_PM
+	.suspend		= msi_claw_suspend,
 	.resume			= msi_claw_resume,
 #endif
 };
@@ -0,0 +1,447 @@
+/*
+ * Replay a hid-msi-claw traffic capture through uhid.
+ *
+ * The capture is read from /sys/kernel/debug/hid/<device>/msi-claw/capture
+ * once capture_enabled has been set. Reports the device sent are fed back
+ * to the driver with their original spacing (scaled by -s), commands the
+ * driver sends are compared against the ones recorded. The sysfs accesses
+ * that started each transaction are repeated on the virtual device so that
+ * the driver issues those commands again.
+ *
+ * The driver only binds to the virtual device with allow_non_usb=1.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <endian.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#define MSI_CLAW_CAPTURE_MAGIC "MCLC"
+#define MSI_CLAW_CAPTURE_VERSION 2
+
+#define MSI_CLAW_CAPTURE_IN 0x00
+#define MSI_CLAW_CAPTURE_OUT 0x01
+#define MSI_CLAW_CAPTURE_ACTION 0x02
+
+#define MSI_CLAW_CAPTURE_TRUNCATED 0x01
+
+#define MAX_ACTIONS 256
+
+// how long to wait for the driver to issue a recorded command
+#define OUTPUT_TIMEOUT_MS 5000
+
+struct msi_claw_capture_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+} __attribute__((packed));
+
+struct msi_claw_capture_record {
+	uint64_t timestamp_ns;
+	uint8_t direction;
+	uint8_t flags;
+	uint16_t size;
+} __attribute__((packed));
+
+// sysfs access repeated from its own thread, as it blocks until the transaction is over
+struct action {
+	pthread_t thread;
+	char path[512];
+	char value[64];
+	int write;
+	int ret;
+};
+
+// vendor collection of the control interface: 0x10 input and 0x0f output reports
+static const uint8_t control_rdesc[] = {
+	0x06, 0x00, 0xff,	// Usage Page (Vendor Defined 0xFF00)
+	0x09, 0x01,		// Usage (0x01)
+	0xa1, 0x01,		// Collection (Application)
+	0x85, 0x10,		//   Report ID (0x10)
+	0x09, 0x02,		//   Usage (0x02)
+	0x15, 0x00,		//   Logical Minimum (0)
+	0x26, 0xff, 0x00,	//   Logical Maximum (255)
+	0x75, 0x08,		//   Report Size (8)
+	0x95, 0x3f,		//   Report Count (63)
+	0x81, 0x02,		//   Input (Data,Var,Abs)
+	0x85, 0x0f,		//   Report ID (0x0f)
+	0x09, 0x03,		//   Usage (0x03)
+	0x95, 0x3f,		//   Report Count (63)
+	0x91, 0x02,		//   Output (Data,Var,Abs)
+	0xc0,			// End Collection
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-s speed] [-d rdesc] capture\n", argv0);
+	fprintf(stderr, "  -s speed  replay speed factor, 0 for no delays (default 1)\n");
+	fprintf(stderr, "  -d rdesc  report descriptor of the captured interface (default: control)\n");
+}
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	ssize_t ret = write(fd, ev, sizeof(*ev));
+
+	if (ret < 0)
+		return -errno;
+
+	return (ret == sizeof(*ev)) ? 0 : -EFAULT;
+}
+
+static int uhid_create(int fd, const uint8_t *rdesc, size_t rdesc_size, const char *uniq)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	strcpy((char *)ev.u.create2.name, "MSI Claw replay");
+	snprintf((char *)ev.u.create2.uniq, sizeof(ev.u.create2.uniq), "%s", uniq);
+	memcpy(ev.u.create2.rd_data, rdesc, rdesc_size);
+	ev.u.create2.rd_size = rdesc_size;
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = 0x0db0;
+	ev.u.create2.product = 0x1901;
+
+	return uhid_write(fd, &ev);
+}
+
+// wait for the next output report of the driver, skipping other uhid events
+static int uhid_await_output(int fd, struct uhid_output_req *out, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct uhid_event ev;
+	ssize_t ret;
+
+	for (;;) {
+		ret = poll(&pfd, 1, timeout_ms);
+		if (ret < 0)
+			return -errno;
+		else if (ret == 0)
+			return -ETIMEDOUT;
+
+		ret = read(fd, &ev, sizeof(ev));
+		if (ret < 0)
+			return -errno;
+
+		if (ev.type == UHID_OUTPUT) {
+			*out = ev.u.output;
+			return 0;
+		}
+	}
+}
+
+static void sleep_ns(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+		;
+}
+
+static uint8_t *read_file(const char *path, size_t *size);
+
+// sysfs directory of the hid device created by uhid_create()
+static int find_device(const char *uniq, char *dir, size_t dir_size)
+{
+	char path[512], match[128];
+	struct dirent *dirent;
+	uint8_t *uevent;
+	size_t size;
+	DIR *devices;
+	int ret = -ENODEV;
+
+	devices = opendir("/sys/bus/hid/devices");
+	if (!devices)
+		return -errno;
+
+	snprintf(match, sizeof(match), "HID_UNIQ=%s\n", uniq);
+
+	while ((ret == -ENODEV) && (dirent = readdir(devices))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/bus/hid/devices/%s/uevent", dirent->d_name);
+		uevent = read_file(path, &size);
+		if (!uevent)
+			continue;
+
+		if (memmem(uevent, size, match, strlen(match))) {
+			snprintf(dir, dir_size, "/sys/bus/hid/devices/%s", dirent->d_name);
+			ret = 0;
+		}
+
+		free(uevent);
+	}
+
+	closedir(devices);
+
+	return ret;
+}
+
+static void *action_run(void *arg)
+{
+	struct action *action = arg;
+	char buf[64];
+	ssize_t ret;
+	int fd;
+
+	fd = open(action->path, action->write ? O_WRONLY : O_RDONLY);
+	if (fd < 0) {
+		action->ret = -errno;
+		return NULL;
+	}
+
+	if (action->write)
+		ret = write(fd, action->value, strlen(action->value));
+	else
+		ret = read(fd, buf, sizeof(buf));
+
+	action->ret = (ret < 0) ? -errno : 0;
+	close(fd);
+
+	return NULL;
+}
+
+// start the sysfs access recorded as "<attribute>" or "<attribute>=<value>"
+static int action_start(struct action *action, const char *dir, const uint8_t *data, size_t size)
+{
+	char name[64];
+	const char *value;
+	int ret;
+
+	if (size >= sizeof(name))
+		return -EINVAL;
+
+	memcpy(name, data, size);
+	name[size] = '\0';
+
+	value = strchr(name, '=');
+	action->write = (value != NULL);
+	if (value != NULL) {
+		snprintf(action->value, sizeof(action->value), "%s", value + 1);
+		name[value - name] = '\0';
+	}
+
+	if (strchr(name, '/') || !strcmp(name, ".."))
+		return -EINVAL;
+
+	// actions not backed by an attribute, e.g. resume, can't be repeated
+	snprintf(action->path, sizeof(action->path), "%s/%s", dir, name);
+	if (access(action->path, action->write ? W_OK : R_OK))
+		return -errno;
+
+	ret = pthread_create(&action->thread, NULL, action_run, action);
+
+	return -ret;
+}
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+	uint8_t *buf = NULL;
+	size_t len = 0, cap = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	do {
+		if (len == cap) {
+			cap = cap ? cap * 2 : 4096;
+			buf = realloc(buf, cap);
+			if (!buf)
+				break;
+		}
+
+		ret = read(fd, &buf[len], cap - len);
+		if (ret < 0) {
+			free(buf);
+			buf = NULL;
+			break;
+		}
+
+		len += ret;
+	} while (ret > 0);
+
+	close(fd);
+	*size = len;
+
+	return buf;
+}
+
+int main(int argc, char **argv)
+{
+	const struct msi_claw_capture_header *header;
+	const struct msi_claw_capture_record *record;
+	const uint8_t *data;
+	struct uhid_output_req out;
+	struct uhid_event ev;
+	const uint8_t *rdesc = control_rdesc;
+	size_t rdesc_size = sizeof(control_rdesc);
+	uint8_t *capture, *custom_rdesc = NULL;
+	static struct action actions[MAX_ACTIONS];
+	char uniq[64], dir[384];
+	uint64_t last_ns = 0, ts;
+	size_t size, pos, record_size;
+	double speed = 1.0;
+	int fd, opt, ret, i, mismatches = 0, nactions = 0, skipping = 0;
+
+	while ((opt = getopt(argc, argv, "s:d:h")) != -1) {
+		switch (opt) {
+		case 's':
+			speed = strtod(optarg, NULL);
+			break;
+		case 'd':
+			custom_rdesc = read_file(optarg, &rdesc_size);
+			if ((!custom_rdesc) || (!rdesc_size) || (rdesc_size > HID_MAX_DESCRIPTOR_SIZE)) {
+				fprintf(stderr, "invalid report descriptor: %s\n", optarg);
+				return 1;
+			}
+			rdesc = custom_rdesc;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if ((optind != argc - 1) || (speed < 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	capture = read_file(argv[optind], &size);
+	if (!capture) {
+		fprintf(stderr, "can't read capture %s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	header = (const struct msi_claw_capture_header *)capture;
+	if ((size < sizeof(*header)) || memcmp(header->magic, MSI_CLAW_CAPTURE_MAGIC, sizeof(header->magic)) ||
+	    (le16toh(header->version) != MSI_CLAW_CAPTURE_VERSION)) {
+		fprintf(stderr, "%s is not a hid-msi-claw capture\n", argv[optind]);
+		return 1;
+	}
+
+	fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "can't open /dev/uhid: %s\n", strerror(errno));
+		return 1;
+	}
+
+	snprintf(uniq, sizeof(uniq), "msi-claw-replay-%d", (int)getpid());
+	ret = uhid_create(fd, rdesc, rdesc_size, uniq);
+	if (ret) {
+		fprintf(stderr, "can't create uhid device: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	// give the driver time to probe before the first report
+	sleep_ns(1000000000ULL);
+
+	ret = find_device(uniq, dir, sizeof(dir));
+	if (ret) {
+		fprintf(stderr, "can't find the uhid device in sysfs: %s\n", strerror(-ret));
+		dir[0] = '\0';
+	}
+
+	pos = sizeof(*header);
+	while (pos + sizeof(*record) <= size) {
+		record = (const struct msi_claw_capture_record *)&capture[pos];
+		record_size = le16toh(record->size);
+		data = &capture[pos + sizeof(*record)];
+		if (pos + sizeof(*record) + record_size > size) {
+			fprintf(stderr, "truncated record at offset %zu\n", pos);
+			break;
+		}
+
+		ts = le64toh(record->timestamp_ns);
+
+		if (record->flags & MSI_CLAW_CAPTURE_TRUNCATED)
+			fprintf(stderr, "report at offset %zu was cut to %zu bytes by the capture\n", pos, record_size);
+
+		if (record->direction == MSI_CLAW_CAPTURE_ACTION) {
+			skipping = 0;
+			if (nactions == MAX_ACTIONS) {
+				fprintf(stderr, "too many actions: skipping the transaction\n");
+				skipping = 1;
+			} else if (!dir[0] || (ret = action_start(&actions[nactions], dir, data, record_size))) {
+				fprintf(stderr, "can't repeat action %.*s: skipping the transaction\n",
+					(int)record_size, (const char *)data);
+				skipping = 1;
+			} else {
+				nactions++;
+			}
+		} else if (skipping) {
+			// traffic of a transaction that could not be started again
+		} else if (record->direction == MSI_CLAW_CAPTURE_OUT) {
+			ret = uhid_await_output(fd, &out, OUTPUT_TIMEOUT_MS);
+			if (ret) {
+				fprintf(stderr, "no command from the driver, expected 0x%02x: %s\n",
+					record_size > 4 ? data[4] : 0, strerror(-ret));
+				mismatches++;
+			} else if ((out.size != record_size) || memcmp(out.data, data, record_size)) {
+				fprintf(stderr, "command mismatch: expected 0x%02x, got 0x%02x\n",
+					record_size > 4 ? data[4] : 0, out.size > 4 ? out.data[4] : 0);
+				mismatches++;
+			}
+		} else {
+			if ((speed > 0) && last_ns && (ts > last_ns))
+				sleep_ns((uint64_t)((ts - last_ns) / speed));
+
+			if (record_size > sizeof(ev.u.input2.data)) {
+				fprintf(stderr, "report at offset %zu too long for uhid\n", pos);
+				break;
+			}
+
+			memset(&ev, 0, sizeof(ev));
+			ev.type = UHID_INPUT2;
+			ev.u.input2.size = record_size;
+			memcpy(ev.u.input2.data, data, record_size);
+
+			ret = uhid_write(fd, &ev);
+			if (ret) {
+				fprintf(stderr, "can't send report: %s\n", strerror(-ret));
+				break;
+			}
+		}
+
+		last_ns = ts;
+		pos += sizeof(*record) + record_size;
+	}
+
+	for (i = 0; i < nactions; i++) {
+		pthread_join(actions[i].thread, NULL);
+		if (actions[i].ret)
+			fprintf(stderr, "%s failed: %s\n", actions[i].path, strerror(-actions[i].ret));
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_write(fd, &ev);
+
+	close(fd);
+	free(custom_rdesc);
+	free(capture);
+
+	printf("replay done, %d command mismatches\n", mismatches);
+
+	return mismatches ? 2 : 0;
+}